@@ -1,16 +1,40 @@
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <stdio.h>
 
 #include "btree.h"
 
+#if NODE_FILE && NODE_HUGE_PAGES
+#error "NODE_FILE and NODE_HUGE_PAGES can't be used together"
+#endif
+
+#if NODE_FILE || NODE_HUGE_PAGES
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#if NODE_FILE
+#include <fcntl.h>
+#endif
+#if NODE_HUGE_PAGES
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+
 #define CAPACITY (2 * B - 1)
 #define MIN_LEN_AFTER_SPLIT (B - 1)
 #define KV_IDX_CENTER (B - 1)
 #define EDGE_IDX_LEFT_OF_CENTER (B - 1)
 #define EDGE_IDX_RIGHT_OF_CENTER B
 
+/* Round node sizes up to whole cache lines, so that nodes carved out of a node
+   file or huge page region start on a cache line like their layout expects. */
+#define NODE_ALIGN(size) (((size) + 63) & ~(size_t)63)
+
 static inline void *_alloc_checked(size_t size) {
   void *ptr = ALLOC(size);
   if (ptr == NULL) {
@@ -19,7 +43,16 @@ static inline void *_alloc_checked(size_t size) {
   return ptr;
 }
 
-#define NEW(type) ((type *)_alloc_checked(sizeof(type)))
+#if NODE_FILE || NODE_HUGE_PAGES
+#define ALLOC_NODE(size) node_region_alloc(size)
+#define DEALLOC_NODE(ptr, size) node_region_dealloc(ptr, size)
+#else
+#define ALLOC_NODE(size) ALLOC(size)
+#define DEALLOC_NODE(ptr, size) DEALLOC(ptr)
+#endif
+
+/* Allocate a node, nodes don't necessarily come from the BTreeMap allocator. */
+#define NEW(type) ((type *)_alloc_node_checked(sizeof(type)))
 
 typedef unsigned short ushort;
 
@@ -29,13 +62,26 @@ struct leaf_node {
   /* Keys and values, only elements up to `len` are initialized and valid. */
   K keys[CAPACITY];
   V vals[CAPACITY];
+#if LAZY_REMOVE
+  /* Whether each element has been removed, see LAZY_REMOVE. */
+  bool dead[CAPACITY];
+#endif
 };
 
 struct inode {
+#if INODE_CHILDREN_FIRST
+  /* Only `len + 1` elements of the array are initialized. Stored right before
+     `data` so that the children are next to the keys, and the values are only
+     touched when a key is found. */
+  struct leaf_node *children[CAPACITY + 1];
+  /* Any node can be dereferenced as a leaf node. */
+  struct leaf_node data;
+#else
   /* Any node can be dereferenced as a leaf node. */
   struct leaf_node data;
   /* Only `len + 1` elements of the array are initialized. */
   struct leaf_node *children[CAPACITY + 1];
+#endif
 };
 
 struct node_ref {
@@ -45,6 +91,384 @@ struct node_ref {
   size_t height;
 };
 
+#if NODE_FILE || NODE_HUGE_PAGES
+/* A range of address space that nodes of one size are carved from. */
+struct node_region {
+  char *base;
+  size_t max_size;
+  /* How many bytes of the region have been handed out to nodes. */
+  size_t used;
+#if NODE_FILE
+  /* How many bytes of the region have blocks reserved in the file. */
+  size_t backed;
+#endif
+  /* Deallocated nodes, linked through their first bytes. */
+  void *free;
+};
+
+/* Internal nodes and leaves live in different regions, so that the internal
+   nodes every lookup walks through are packed together. */
+static struct node_region inode_region;
+static struct node_region leaf_region;
+
+/* Maps on different threads allocate from the same regions. */
+static pthread_mutex_t node_region_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The size of the internal node region above a leaf region of `leaf_size`
+   bytes. Internal nodes other than the root have at least B children, so
+   there is at most one for every B - 1 leaves. */
+static size_t node_region_inode_size(size_t leaf_size) {
+  size_t leaves_count = leaf_size / NODE_ALIGN(sizeof(struct leaf_node));
+  return (leaves_count / (B - 1) + 1) * NODE_ALIGN(sizeof(struct inode));
+}
+
+static struct node_region *node_region_of(size_t size) {
+  return size == sizeof(struct leaf_node) ? &leaf_region : &inode_region;
+}
+
+static bool node_region_contains(struct node_region *region, void *ptr) {
+  return region->base != NULL && (char *)ptr >= region->base &&
+         (char *)ptr < region->base + region->max_size;
+}
+#endif
+
+#if NODE_FILE
+/* Grow the node file by this many bytes at a time. */
+#define NODE_FILE_GROW ((size_t)1 << 24)
+/* Evict this many bytes of leaves at a time to stay within the budget, and
+   check the budget every time this many bytes of nodes were allocated. */
+#define NODE_FILE_EVICT ((size_t)1 << 20)
+
+struct node_file {
+  int fd;
+  /* The whole file is mapped at `base`, so nodes never move. The internal
+     node region comes first, followed by the leaf region. */
+  char *base;
+  size_t max_size;
+  size_t page_size;
+  /* How many bytes of the file may be in memory, or 0 for no limit. */
+  size_t max_resident;
+  /* Where in the leaf region to evict next. */
+  size_t evict_from;
+  /* How many bytes of nodes were allocated since the budget was checked. */
+  size_t allocated;
+};
+
+static struct node_file node_file = {-1, NULL, 0, 0, 0, 0, 0};
+
+/* How many bytes of `[start, start + size)` are in memory. */
+static size_t node_file_resident(char *start, size_t size) {
+  unsigned char vec[NODE_FILE_EVICT / 4096];
+  size_t chunk = sizeof(vec) * node_file.page_size;
+  size_t resident = 0;
+  for (size_t offset = 0; offset < size; offset += chunk) {
+    size_t len = size - offset < chunk ? size - offset : chunk;
+    if (mincore(start + offset, len, vec) != 0) {
+      continue;
+    }
+    size_t pages = (len + node_file.page_size - 1) / node_file.page_size;
+    for (size_t i = 0; i < pages; ++i) {
+      resident += (vec[i] & 1) * node_file.page_size;
+    }
+  }
+  return resident;
+}
+
+/* Write leaves back to the file and drop them from memory until the file
+   fits in its budget. Leaves are evicted round-robin since nothing tells
+   which ones are hot, while internal nodes always stay. */
+static bool node_file_trim_locked(void) {
+  if (node_file.max_resident == 0) {
+    return true;
+  }
+  size_t resident = node_file_resident(inode_region.base, inode_region.used) +
+                    node_file_resident(leaf_region.base, leaf_region.used);
+  for (size_t evicted = 0;
+       resident > node_file.max_resident && evicted < leaf_region.used;
+       evicted += NODE_FILE_EVICT) {
+    if (node_file.evict_from >= leaf_region.used) {
+      node_file.evict_from = 0;
+    }
+    char *start = leaf_region.base + node_file.evict_from;
+    size_t len = leaf_region.used - node_file.evict_from;
+    if (len > NODE_FILE_EVICT) {
+      len = NODE_FILE_EVICT;
+    }
+    size_t before = node_file_resident(start, len);
+    /* The pages must be clean for the kernel to drop them from the page
+       cache, unmapping them alone would keep them there. */
+    if (msync(start, len, MS_SYNC) != 0 ||
+        madvise(start, len, MADV_DONTNEED) != 0) {
+      return false;
+    }
+    int err = posix_fadvise(node_file.fd, (off_t)(start - node_file.base),
+                            (off_t)len, POSIX_FADV_DONTNEED);
+    if (err != 0) {
+      errno = err;
+      return false;
+    }
+    resident -= before;
+    node_file.evict_from += len;
+  }
+  return true;
+}
+
+/* Reserve the blocks of the file behind the next `size` bytes of `region`,
+   writing to a hole in the mapping when the disk is full would raise SIGBUS
+   instead. */
+static bool node_file_reserve(struct node_region *region, size_t size) {
+  node_file.allocated += size;
+  if (node_file.allocated >= NODE_FILE_EVICT) {
+    /* A failure only leaves more in memory. */
+    node_file.allocated = 0;
+    node_file_trim_locked();
+  }
+  if (region->used + size <= region->backed) {
+    return true;
+  }
+  size_t grow = region->max_size - region->backed;
+  if (grow > NODE_FILE_GROW) {
+    grow = NODE_FILE_GROW;
+  }
+  off_t offset = (off_t)(region->base - node_file.base + region->backed);
+  if (posix_fallocate(node_file.fd, offset, (off_t)grow) != 0) {
+    return false;
+  }
+  region->backed += grow;
+  return true;
+}
+
+bool btree_node_file_open(const char *path, size_t max_size,
+                          size_t max_resident) {
+  assert(node_file.base == NULL);
+  /* Start the leaves on a page of their own, msync and madvise work on whole
+     pages. */
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t inode_size =
+      (node_region_inode_size(max_size) + page_size - 1) & ~(page_size - 1);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    return false;
+  }
+  char *base = mmap(NULL, inode_size + max_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return false;
+  }
+  /* Lookups jump around the file, reading ahead is just wasted memory. */
+  madvise(base, inode_size + max_size, MADV_RANDOM);
+  node_file = (struct node_file){
+      fd, base, inode_size + max_size, page_size, max_resident, 0, 0};
+  inode_region = (struct node_region){base, inode_size, 0, 0, NULL};
+  leaf_region = (struct node_region){base + inode_size, max_size, 0, 0, NULL};
+  return true;
+}
+
+bool btree_node_file_sync(void) {
+  assert(node_file.base != NULL);
+  return msync(inode_region.base, inode_region.used, MS_SYNC) == 0 &&
+         msync(leaf_region.base, leaf_region.used, MS_SYNC) == 0;
+}
+
+bool btree_node_file_trim(void) {
+  assert(node_file.base != NULL);
+  pthread_mutex_lock(&node_region_lock);
+  bool trimmed = node_file_trim_locked();
+  pthread_mutex_unlock(&node_region_lock);
+  return trimmed;
+}
+
+void btree_node_file_close(void) {
+  if (node_file.base == NULL) {
+    return;
+  }
+  munmap(node_file.base, node_file.max_size);
+  close(node_file.fd);
+  node_file = (struct node_file){-1, NULL, 0, 0, 0, 0, 0};
+  inode_region = (struct node_region){NULL, 0, 0, 0, NULL};
+  leaf_region = (struct node_region){NULL, 0, 0, 0, NULL};
+}
+#endif
+
+#if NODE_HUGE_PAGES
+#define HUGE_PAGE_SIZE ((size_t)1 << 21)
+#define HUGE_PAGES_ROUND(size)                                                 \
+  (((size) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1))
+
+/* The bits of a NUMA node mask, enough for any machine we run on. */
+#define NUMA_MAX_NODES 1024
+
+/* Map `size` bytes backed by huge pages. Pages reserved for hugetlbfs are used
+   if there are enough of them, otherwise transparent huge pages. */
+static void *huge_pages_map(size_t size) {
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (base != MAP_FAILED) {
+    return base;
+  }
+  /* Over-allocate to align the start on a huge page, the kernel only backs
+     aligned ranges with transparent huge pages. */
+  char *raw = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (raw == MAP_FAILED) {
+    return NULL;
+  }
+  char *aligned =
+      (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+  if (aligned != raw) {
+    munmap(raw, (size_t)(aligned - raw));
+  }
+  munmap(aligned + size, (size_t)(raw + HUGE_PAGE_SIZE - aligned));
+  if (madvise(aligned, size, MADV_HUGEPAGE) != 0) {
+    int err = errno;
+    munmap(aligned, size);
+    errno = err;
+    return NULL;
+  }
+  return aligned;
+}
+
+/* Set the NUMA policy of the pages of a region, they're only allocated when
+   first touched so this applies to all of them. */
+static bool huge_pages_bind(void *base, size_t size, int mode,
+                            unsigned long const *mask) {
+  return syscall(SYS_mbind, base, size, mode, mask, NUMA_MAX_NODES, 0) == 0;
+}
+
+static bool huge_pages_place(int leaf_numa_node) {
+  unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+  if (syscall(SYS_get_mempolicy, NULL, mask, NUMA_MAX_NODES, NULL,
+              MPOL_F_MEMS_ALLOWED) != 0) {
+    /* Without NUMA support there's nothing to place. */
+    return errno == ENOSYS && leaf_numa_node < 0;
+  }
+  size_t nodes = 0;
+  for (size_t i = 0; i < sizeof(mask) / sizeof(mask[0]); ++i) {
+    nodes += (size_t)__builtin_popcountl(mask[i]);
+  }
+  /* Every thread walks the internal nodes, spread them over all the nodes
+     rather than making one node serve all the traffic. */
+  if (nodes > 1 && !huge_pages_bind(inode_region.base, inode_region.max_size,
+                                    MPOL_INTERLEAVE, mask)) {
+    return false;
+  }
+  if (leaf_numa_node >= 0) {
+    if (leaf_numa_node >= NUMA_MAX_NODES) {
+      errno = EINVAL;
+      return false;
+    }
+    unsigned long leaf_mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {
+        0};
+    size_t bits = 8 * sizeof(unsigned long);
+    leaf_mask[leaf_numa_node / bits] = 1ul << (leaf_numa_node % bits);
+    return huge_pages_bind(leaf_region.base, leaf_region.max_size,
+                           MPOL_PREFERRED, leaf_mask);
+  }
+  return true;
+}
+
+bool btree_huge_pages_open(size_t max_size, int leaf_numa_node) {
+  assert(leaf_region.base == NULL);
+  max_size = HUGE_PAGES_ROUND(max_size);
+  size_t inode_size = HUGE_PAGES_ROUND(node_region_inode_size(max_size));
+  char *leaves = huge_pages_map(max_size);
+  if (leaves == NULL) {
+    return false;
+  }
+  char *inodes = huge_pages_map(inode_size);
+  if (inodes == NULL) {
+    int err = errno;
+    munmap(leaves, max_size);
+    errno = err;
+    return false;
+  }
+  leaf_region = (struct node_region){leaves, max_size, 0, NULL};
+  inode_region = (struct node_region){inodes, inode_size, 0, NULL};
+  if (!huge_pages_place(leaf_numa_node)) {
+    int err = errno;
+    btree_huge_pages_close();
+    errno = err;
+    return false;
+  }
+  return true;
+}
+
+void btree_huge_pages_close(void) {
+  if (leaf_region.base == NULL) {
+    return;
+  }
+  munmap(leaf_region.base, leaf_region.max_size);
+  munmap(inode_region.base, inode_region.max_size);
+  leaf_region = (struct node_region){NULL, 0, 0, NULL};
+  inode_region = (struct node_region){NULL, 0, 0, NULL};
+}
+#endif
+
+#if NODE_FILE || NODE_HUGE_PAGES
+/* Take a node of `size` bytes from its region, or return NULL if the region
+   isn't open or is full. */
+static void *node_region_take(size_t size) {
+  struct node_region *region = node_region_of(size);
+  if (region->base == NULL) {
+    return NULL;
+  }
+  if (region->free != NULL) {
+    void *ptr = region->free;
+    region->free = *(void **)ptr;
+    return ptr;
+  }
+  size_t aligned = NODE_ALIGN(size);
+  if (region->max_size - region->used < aligned) {
+    return NULL;
+  }
+#if NODE_FILE
+  if (!node_file_reserve(region, aligned)) {
+    return NULL;
+  }
+#endif
+  void *ptr = region->base + region->used;
+  region->used += aligned;
+  return ptr;
+}
+
+static void *node_region_alloc(size_t size) {
+  pthread_mutex_lock(&node_region_lock);
+  void *ptr = node_region_take(size);
+  pthread_mutex_unlock(&node_region_lock);
+  if (ptr == NULL) {
+    /* Dealloc tells the nodes apart by their address. */
+    return ALLOC(size);
+  }
+  return ptr;
+}
+
+static void node_region_dealloc(void *ptr, size_t size) {
+  struct node_region *region = node_region_of(size);
+  pthread_mutex_lock(&node_region_lock);
+  bool contains = node_region_contains(region, ptr);
+  if (contains) {
+    *(void **)ptr = region->free;
+    region->free = ptr;
+  }
+  pthread_mutex_unlock(&node_region_lock);
+  if (!contains) {
+    /* Allocated before the region was opened, or after it was full. */
+    DEALLOC(ptr);
+  }
+}
+#endif
+
+static inline void *_alloc_node_checked(size_t size) {
+  void *ptr = ALLOC_NODE(size);
+  if (ptr == NULL) {
+    OOM();
+  }
+  return ptr;
+}
+
 /* Initialize a leaf node */
 static void leaf_node_init(struct leaf_node *node) { node->len = 0; }
 
@@ -67,7 +491,11 @@ static struct node_ref node_ref_from_root(struct btree_map *map) {
   return (struct node_ref){(struct leaf_node *)map->root, map->height};
 }
 
-#define inode_cast(node_ref) ((struct inode *)((node_ref).node))
+/* Get the internal node a leaf node pointer belongs to. Node pointers always
+   point to the `data` of internal nodes, which may not be at their start. */
+#define inode_from_leaf(leaf)                                                  \
+  ((struct inode *)((char *)(leaf) - offsetof(struct inode, data)))
+#define inode_cast(node_ref) inode_from_leaf((node_ref).node)
 
 /* Check whether this node_ref references a leaf node */
 static inline bool node_ref_is_leaf(struct node_ref node_ref) {
@@ -90,11 +518,95 @@ static struct node_ref node_ref_descend(struct node_ref node_ref,
                            node_ref.height - 1};
 }
 
+/* Deallocate a single node, without its children. */
+static void node_ref_free(struct node_ref node_ref) {
+  if (node_ref_is_leaf(node_ref)) {
+    DEALLOC_NODE(node_ref.node, sizeof(struct leaf_node));
+  } else {
+    DEALLOC_NODE(inode_cast(node_ref), sizeof(struct inode));
+  }
+}
+
 struct kv {
   K k;
   V v;
+#if LAZY_REMOVE
+  bool dead;
+#endif
 };
 
+/* A new element, which is not dead. */
+static inline struct kv kv_new(K key, V value) {
+  struct kv kv;
+  kv.k = key;
+  kv.v = value;
+#if LAZY_REMOVE
+  kv.dead = false;
+#endif
+  return kv;
+}
+
+static inline struct kv node_kv(struct leaf_node *node, ushort index) {
+  struct kv kv;
+  kv.k = node->keys[index];
+  kv.v = node->vals[index];
+#if LAZY_REMOVE
+  kv.dead = node->dead[index];
+#endif
+  return kv;
+}
+
+static inline void node_set_kv(struct leaf_node *node, ushort index,
+                               struct kv kv) {
+  node->keys[index] = kv.k;
+  node->vals[index] = kv.v;
+#if LAZY_REMOVE
+  node->dead[index] = kv.dead;
+#endif
+}
+
+#if LAZY_REMOVE
+/* Deallocate an element that is dropped from the map. */
+static void kv_dealloc(struct kv kv) {
+#if IS_DEALLOC_ELEMENT
+  DEALLOC_KEY(kv.k);
+  DEALLOC_VALUE(kv.v);
+#else
+  (void)kv;
+#endif
+}
+
+/* Bring back the dead element at index with a new key and value. The map owns
+   the dead key and value, so they're deallocated as if the element had been
+   purged. Both keys compare equal, so the order is unchanged. */
+static void node_revive(struct leaf_node *node, ushort index, K key,
+                        V value) {
+  assert(node->dead[index]);
+#if IS_DEALLOC_ELEMENT
+  /* The caller may insert the very key or value it removed, which the map
+     hasn't deallocated yet. */
+  if (memcmp(&node->keys[index], &key, sizeof(K)) != 0) {
+    DEALLOC_KEY(node->keys[index]);
+  }
+  if (memcmp(&node->vals[index], &value, sizeof(V)) != 0) {
+    DEALLOC_VALUE(node->vals[index]);
+  }
+#endif
+  node_set_kv(node, index, kv_new(key, value));
+}
+#endif
+
+/* Move `count` elements from src to dst, the ranges may overlap. */
+static inline void node_move(struct leaf_node *dst, ushort dst_index,
+                             struct leaf_node *src, ushort src_index,
+                             ushort count) {
+  memmove(&dst->keys[dst_index], &src->keys[src_index], count * sizeof(K));
+  memmove(&dst->vals[dst_index], &src->vals[src_index], count * sizeof(V));
+#if LAZY_REMOVE
+  memmove(&dst->dead[dst_index], &src->dead[src_index], count * sizeof(bool));
+#endif
+}
+
 struct split {
   struct leaf_node *node;
   struct kv kv;
@@ -114,9 +626,8 @@ static struct kv node_split_leaf_data(struct leaf_node *old_node,
   ushort new_len = old_len - index - 1;
   new_node->len = new_len;
   old_node->len = index;
-  memcpy(new_node->keys, &old_node->keys[index + 1], new_len * sizeof(K));
-  memcpy(new_node->vals, &old_node->vals[index + 1], new_len * sizeof(V));
-  return (struct kv){old_node->keys[index], old_node->vals[index]};
+  node_move(new_node, 0, old_node, index + 1, new_len);
+  return node_kv(old_node, index);
 }
 
 /* Splits a node reference and returns a newly allocated node. */
@@ -131,12 +642,12 @@ static struct split node_ref_split(struct node_ref node, ushort index) {
     ushort new_len = new_inode->data.len;
     memcpy(new_inode->children, &inode_cast(node)->children[index + 1],
            (new_len + 1) * sizeof(struct leaf_node *));
-    return (struct split){(struct leaf_node *)new_inode, kv};
+    return (struct split){&new_inode->data, kv};
   }
 }
 
 static struct kv node_remove_unchecked(struct leaf_node *node, ushort index) {
-  struct kv kv = {node->keys[index], node->vals[index]};
+  struct kv kv = node_kv(node, index);
   if (index < node->len) {
     /* We have to remove a kv pair from the middle of the arrays. So we have to
        shift back one or more elements to fill the gap.
@@ -144,10 +655,7 @@ static struct kv node_remove_unchecked(struct leaf_node *node, ushort index) {
         <-|
        ABDEF
      */
-    memmove(&node->keys[index], &node->keys[index + 1],
-            (node->len - index - 1) * sizeof(K));
-    memmove(&node->vals[index], &node->vals[index + 1],
-            (node->len - index - 1) * sizeof(V));
+    node_move(node, index, node, index + 1, node->len - index - 1);
   }
   node->len -= 1;
   return kv;
@@ -166,42 +674,26 @@ static void node_remove_child(struct inode *node, ushort index) {
   }
 }
 
-static void node_ref_borrow_from_left(struct node_ref parent, ushort index) {
+/* Move `shift` key/value pairs from the child at `index - 1` to the child at
+   `index`, rotating them through the separating key/value pair in parent. */
+static void node_ref_shift_right(struct node_ref parent, ushort index,
+                                 ushort shift) {
   struct node_ref left = node_ref_descend(parent, index - 1);
   struct node_ref right = node_ref_descend(parent, index);
 
-  // printf("LEFT:\n");
-  // for (ushort i = 0; i < left.node->len; ++i) {
-  //   printf("%i => %i\n", left.node->keys[i], left.node->vals[i]);
-  // }
-  // printf("RIGHT:\n");
-  // for (ushort i = 0; i < right.node->len; ++i) {
-  //   printf("%i => %i\n", right.node->keys[i], right.node->vals[i]);
-  // }
-
   ushort left_len = left.node->len;
   ushort right_len = right.node->len;
 
-  ushort shift = ((right_len + left_len) >> 1) - right_len;
-
   /* Make space for the borrowed key/values */
-  memmove(&right.node->keys[shift], right.node->keys, right_len * sizeof(K));
-  memmove(&right.node->vals[shift], right.node->vals, right_len * sizeof(V));
+  node_move(right.node, shift, right.node, 0, right_len);
   if (parent.height > 1) {
     memmove(&inode_cast(right)->children[shift], &inode_cast(right)->children,
             (right_len + 1) * sizeof(struct leaf_node *));
   }
 
-  right.node->keys[shift - 1] = parent.node->keys[index - 1];
-  right.node->vals[shift - 1] = parent.node->vals[index - 1];
-
-  parent.node->keys[index - 1] = left.node->keys[left_len - shift];
-  parent.node->vals[index - 1] = left.node->vals[left_len - shift];
-
-  memcpy(right.node->keys, &left.node->keys[left_len - shift + 1],
-         (shift - 1) * sizeof(K));
-  memcpy(right.node->vals, &left.node->vals[left_len - shift + 1],
-         (shift - 1) * sizeof(V));
+  node_set_kv(right.node, shift - 1, node_kv(parent.node, index - 1));
+  node_set_kv(parent.node, index - 1, node_kv(left.node, left_len - shift));
+  node_move(right.node, 0, left.node, left_len - shift + 1, shift - 1);
   if (parent.height > 1) {
     memcpy(inode_cast(right)->children,
            &inode_cast(left)->children[left_len - shift + 1],
@@ -210,42 +702,35 @@ static void node_ref_borrow_from_left(struct node_ref parent, ushort index) {
 
   left.node->len -= shift;
   right.node->len += shift;
+}
 
-  // printf("LEFT:\n");
-  // for (ushort i = 0; i < left.node->len; ++i) {
-  //   printf("%i => %i\n", left.node->keys[i], left.node->vals[i]);
-  // }
-  // printf("RIGHT:\n");
-  // for (ushort i = 0; i < right.node->len; ++i) {
-  //   printf("%i => %i\n", right.node->keys[i], right.node->vals[i]);
-  // }
+#if !LAZY_REMOVE
+static void node_ref_borrow_from_left(struct node_ref parent, ushort index) {
+  ushort left_len = node_ref_descend(parent, index - 1).node->len;
+  ushort right_len = node_ref_descend(parent, index).node->len;
+  node_ref_shift_right(parent, index,
+                       ((right_len + left_len) >> 1) - right_len);
 }
+#endif
 
-static void node_ref_borrow_from_right(struct node_ref parent, ushort index) {
+/* Move `shift` key/value pairs from the child at `index + 1` to the child at
+   `index`, rotating them through the separating key/value pair in parent. */
+static void node_ref_shift_left(struct node_ref parent, ushort index,
+                                ushort shift) {
   struct node_ref left = node_ref_descend(parent, index);
   struct node_ref right = node_ref_descend(parent, index + 1);
 
   ushort left_len = left.node->len;
   ushort right_len = right.node->len;
-  ushort shift = ((left_len + right_len) >> 1) - left_len;
-
-  left.node->keys[left_len] = parent.node->keys[index];
-  left.node->vals[left_len] = parent.node->vals[index];
-  memcpy(&left.node->keys[left_len + 1], right.node->keys,
-         (shift - 1) * sizeof(K));
-  memcpy(&left.node->vals[left_len + 1], right.node->vals,
-         (shift - 1) * sizeof(V));
+
+  node_set_kv(left.node, left_len, node_kv(parent.node, index));
+  node_move(left.node, left_len + 1, right.node, 0, shift - 1);
   if (parent.height > 1) {
     memcpy(&inode_cast(left)->children[left_len + 1],
            &inode_cast(right)->children, shift * sizeof(struct leaf_node *));
   }
-  parent.node->keys[index] = right.node->keys[shift - 1];
-  parent.node->vals[index] = right.node->vals[shift - 1];
-
-  memmove(right.node->keys, &right.node->keys[shift],
-          (right_len - shift) * sizeof(K));
-  memmove(right.node->vals, &right.node->vals[shift],
-          (right_len - shift) * sizeof(V));
+  node_set_kv(parent.node, index, node_kv(right.node, shift - 1));
+  node_move(right.node, 0, right.node, shift, right_len - shift);
 
   if (parent.height > 1) {
     memmove(inode_cast(right)->children, &inode_cast(right)->children[shift],
@@ -256,6 +741,12 @@ static void node_ref_borrow_from_right(struct node_ref parent, ushort index) {
   right.node->len -= shift;
 }
 
+static void node_ref_borrow_from_right(struct node_ref parent, ushort index) {
+  ushort left_len = node_ref_descend(parent, index).node->len;
+  ushort right_len = node_ref_descend(parent, index + 1).node->len;
+  node_ref_shift_left(parent, index, ((left_len + right_len) >> 1) - left_len);
+}
+
 /* Merges child and child_sibling into child, deallocates node and updates
    parent's children. */
 static void node_ref_merge(struct node_ref parent, ushort index) {
@@ -266,10 +757,7 @@ static void node_ref_merge(struct node_ref parent, ushort index) {
   ushort right_len = right.node->len;
   /* Copy keys and values leaving an uninitialized space for the key/value pair
      in parent associated with child_sibling. */
-  memcpy(&left.node->keys[left_len + 1], right.node->keys,
-         right_len * sizeof(K));
-  memcpy(&left.node->vals[left_len + 1], right.node->vals,
-         right_len * sizeof(V));
+  node_move(left.node, left_len + 1, right.node, 0, right_len);
   if (parent.height > 1) {
     /* The node is internal, copy children. */
     memcpy(&inode_cast(left)->children[left_len + 1],
@@ -277,24 +765,31 @@ static void node_ref_merge(struct node_ref parent, ushort index) {
            (right_len + 1) * sizeof(struct leaf_node *));
   }
   node_remove_child(inode_cast(parent), index + 1);
-  struct kv kv = node_remove_unchecked(parent.node, index);
-  left.node->keys[left_len] = kv.k;
-  left.node->vals[left_len] = kv.v;
+  node_set_kv(left.node, left_len, node_remove_unchecked(parent.node, index));
   left.node->len = left_len + right_len + 1;
   /* We copied everything we needed to copy from child_sibling, deallocate it.
-     We don't use node_ref_dealloc because it would also get rid of child nodes,
-     whose ownership has been transferred to child. */
-  DEALLOC(right.node);
+     We don't use node_ref_dealloc_recursive because it would also get rid of
+     child nodes, whose ownership has been transferred to child. */
+  node_ref_free(right);
 }
 
-/* Search for a key inside a node, this uses a linear search, a binary search
+#if SEARCH == SEARCH_INTERPOLATION && !defined(KEY_POSITION)
+#error "SEARCH_INTERPOLATION requires KEY_POSITION"
+#endif
+
+/* Search for a key inside a node, returning the index of the first key that is
+   not less than `key`. By default this uses a linear search, a binary search
    algorithm could improve performance only if B was a lot higher. Since we
-   search on short arrays (11 elements) linear search is actually faster. */
+   search on short arrays (11 elements) linear search is actually faster. See
+   SEARCH for the alternatives. */
 static ushort node_ref_search(struct node_ref node_ref, K const *key,
                               bool *found) {
+  K const *keys = node_ref.node->keys;
+  ushort len = node_ref.node->len;
+#if SEARCH == SEARCH_LINEAR
   ushort i = 0;
-  for (; i < node_ref.node->len; ++i) {
-    int cmp = COMPARE(key, &node_ref.node->keys[i]);
+  for (; i < len; ++i) {
+    int cmp = COMPARE(key, &keys[i]);
     if (cmp == 0) {
       *found = true;
     }
@@ -303,11 +798,64 @@ static ushort node_ref_search(struct node_ref node_ref, K const *key,
     }
   }
   return i;
+#else
+#if SEARCH == SEARCH_BINARY
+  ushort i = 0;
+  ushort end = len;
+  while (i < end) {
+    ushort mid = i + ((end - i) >> 1);
+    if (COMPARE(key, &keys[mid]) > 0) {
+      i = mid + 1;
+    } else {
+      end = mid;
+    }
+  }
+#elif SEARCH == SEARCH_SIMD
+  /* Count the keys less than `key` without branching or stopping early, which
+     compilers turn into vector compares for integer keys. */
+  ushort i = 0;
+  for (ushort j = 0; j < len; ++j) {
+    i += COMPARE(key, &keys[j]) > 0;
+  }
+#elif SEARCH == SEARCH_INTERPOLATION
+  if (len == 0) {
+    return 0;
+  }
+  /* Guess where the key is from where it falls between the first and the last
+     key, assuming they're evenly spread, then scan from there. */
+  double first = KEY_POSITION(&keys[0]);
+  double last = KEY_POSITION(&keys[len - 1]);
+  double position = KEY_POSITION(key);
+  ushort i;
+  if (position <= first) {
+    i = 0;
+  } else if (position >= last) {
+    i = len - 1;
+  } else {
+    i = (ushort)((position - first) / (last - first) * (len - 1));
+  }
+  if (COMPARE(key, &keys[i]) > 0) {
+    do {
+      i += 1;
+    } while (i < len && COMPARE(key, &keys[i]) > 0);
+  } else {
+    while (i > 0 && COMPARE(key, &keys[i - 1]) <= 0) {
+      i -= 1;
+    }
+  }
+#else
+#error "Unknown SEARCH"
+#endif
+  if (i < len && COMPARE(key, &keys[i]) == 0) {
+    *found = true;
+  }
+  return i;
+#endif
 }
 
 /* index must be <= node->len */
-static void node_insert_unchecked(struct leaf_node *node, ushort index, K key,
-                                  V value) {
+static void node_insert_unchecked(struct leaf_node *node, ushort index,
+                                  struct kv kv) {
   if (index < node->len) {
     /* We have to insert a kv pair in the middle of the arrays. So we have to
        shift forward one or more elements to make space.
@@ -317,16 +865,13 @@ static void node_insert_unchecked(struct leaf_node *node, ushort index, K key,
          ^
          C
      */
-    memmove(&node->keys[index + 1], &node->keys[index],
-            (node->len - index) * sizeof(K));
-    memmove(&node->vals[index + 1], &node->vals[index],
-            (node->len - index) * sizeof(V));
+    node_move(node, index + 1, node, index, node->len - index);
   }
-  node->keys[index] = key;
-  node->vals[index] = value;
+  node_set_kv(node, index, kv);
   node->len += 1;
 }
 
+#if !LAZY_REMOVE
 static void underflow_left(struct node_ref node_ref, ushort index) {
   struct node_ref edge_left = node_ref_descend(node_ref, index);
   if (edge_left.node->len < B - 1) {
@@ -368,6 +913,7 @@ static struct kv node_remove_least(struct node_ref node_ref) {
   check_underflow(node_ref, 0);
   return y;
 }
+#endif
 
 static void node_insert_child(struct inode *node, ushort index,
                               struct leaf_node *child) {
@@ -405,8 +951,8 @@ static ushort node_find_splitpoint(ushort *index, bool *is_left) {
 }
 
 /* index must be <= node_ref.node->len */
-static struct split node_insert(struct node_ref node_ref, ushort index, K key,
-                                V value) {
+static struct split node_insert(struct node_ref node_ref, ushort index,
+                                struct kv kv) {
   if (node_ref_is_full(node_ref)) {
     ushort insert_index = index;
     bool is_left;
@@ -414,19 +960,19 @@ static struct split node_insert(struct node_ref node_ref, ushort index, K key,
     ushort middle_index = node_find_splitpoint(&insert_index, &is_left);
     struct split split = node_ref_split(node_ref, middle_index);
     node_insert_unchecked(is_left ? node_ref.node : split.node, insert_index,
-                          key, value);
+                          kv);
     return split;
   }
 
   /* We just checked that the node is not full. */
-  node_insert_unchecked(node_ref.node, index, key, value);
+  node_insert_unchecked(node_ref.node, index, kv);
 
   return split_none();
 }
 
 /* node_ref must be an internal node */
 static struct split node_insert_with_child(struct node_ref node_ref,
-                                           ushort index, K key, V value,
+                                           ushort index, struct kv kv,
                                            struct leaf_node *child) {
   if (node_ref_is_full(node_ref)) {
     ushort insert_index = index;
@@ -435,14 +981,14 @@ static struct split node_insert_with_child(struct node_ref node_ref,
     ushort middle_index = node_find_splitpoint(&insert_index, &is_left);
     struct split split = node_ref_split(node_ref, middle_index);
     struct inode *insert_node =
-        (struct inode *)(is_left ? node_ref.node : split.node);
-    node_insert_unchecked(&insert_node->data, insert_index, key, value);
+        inode_from_leaf(is_left ? node_ref.node : split.node);
+    node_insert_unchecked(&insert_node->data, insert_index, kv);
     node_insert_child(insert_node, insert_index, child);
     return split;
   }
 
   /* We just checked that the node is not full. */
-  node_insert_unchecked(node_ref.node, index, key, value);
+  node_insert_unchecked(node_ref.node, index, kv);
   node_insert_child(inode_cast(node_ref), index, child);
 
   return split_none();
@@ -453,45 +999,59 @@ static struct split node_insert_recursive(struct node_ref node_ref, K key,
   ushort index = node_ref_search(node_ref, &key, found);
 
   if (*found) {
+#if LAZY_REMOVE
+    if (node_ref.node->dead[index]) {
+      /* The key was removed, bring it back as a new element. */
+      node_revive(node_ref.node, index, key, value);
+      *found = false;
+      return split_none();
+    }
+#endif
     /* We found the key already in the tree, just update the value. */
     node_ref.node->vals[index] = value;
   } else if (node_ref_is_leaf(node_ref)) {
     /* This is a leaf, insert the key and value */
-    return node_insert(node_ref, index, key, value);
+    return node_insert(node_ref, index, kv_new(key, value));
   } else {
     /* Didn't find the key, descend */
     struct split child_split = node_insert_recursive(
         node_ref_descend(node_ref, index), key, value, found);
     if (child_split.node != NULL) {
       /* The child was split */
-      return node_insert_with_child(node_ref, index, child_split.kv.k,
-                                    child_split.kv.v, child_split.node);
+      return node_insert_with_child(node_ref, index, child_split.kv,
+                                    child_split.node);
     }
   }
 
   return split_none();
 }
 
-static bool node_remove_recursive(struct node_ref node_ref, K const *key) {
+#if !LAZY_REMOVE
+/* Remove `key` from the subtree, storing the removed element in `removed`.
+   Returns whether the key was found. */
+static bool node_remove_recursive(struct node_ref node_ref, K const *key,
+                                  struct kv *removed) {
   bool found = false;
   ushort index = node_ref_search(node_ref, key, &found);
   if (found) {
     if (node_ref_is_leaf(node_ref)) {
-      node_remove_unchecked(node_ref.node, index);
+      *removed = node_remove_unchecked(node_ref.node, index);
     } else {
-      struct kv kv = node_remove_least(node_ref_descend(node_ref, index + 1));
-      node_ref.node->keys[index] = kv.k;
-      node_ref.node->vals[index] = kv.v;
+      *removed = node_kv(node_ref.node, index);
+      node_set_kv(node_ref.node, index,
+                  node_remove_least(node_ref_descend(node_ref, index + 1)));
       check_underflow(node_ref, index + 1);
     }
     return true;
   } else if (!node_ref_is_leaf(node_ref) &&
-             node_remove_recursive(node_ref_descend(node_ref, index), key)) {
+             node_remove_recursive(node_ref_descend(node_ref, index), key,
+                                   removed)) {
     check_underflow(node_ref, index);
     return true;
   }
   return false;
 }
+#endif
 
 static void node_ref_dealloc_recursive(struct node_ref node_ref) {
   if (node_ref_is_leaf(node_ref)) {
@@ -501,16 +1061,231 @@ static void node_ref_dealloc_recursive(struct node_ref node_ref) {
       DEALLOC_VALUE(node_ref.node->vals[i]);
     }
 #endif
-    DEALLOC(node_ref.node);
+    node_ref_free(node_ref);
   } else {
     for (ushort index = 0; index <= node_ref.node->len; ++index) {
 #if IS_DEALLOC_ELEMENT
-      DEALLOC_KEY(node_ref.node->keys[index]);
-      DEALLOC_VALUE(node_ref.node->vals[index]);
+      if (index < node_ref.node->len) {
+        DEALLOC_KEY(node_ref.node->keys[index]);
+        DEALLOC_VALUE(node_ref.node->vals[index]);
+      }
 #endif
       node_ref_dealloc_recursive(node_ref_descend(node_ref, index));
     }
-    DEALLOC(node_ref.node);
+    node_ref_free(node_ref);
+  }
+}
+
+/* Rebalance the children at `index` and `index + 1` so that the left one holds
+   up to `target` key/value pairs, merging them if they fit in a single node.
+   Both children are left with at least B - 1 elements even if one of them was
+   underfull. Returns true if the children were merged. */
+static bool node_ref_pack_pair(struct node_ref parent, ushort index,
+                               ushort target) {
+  ushort left_len = node_ref_descend(parent, index).node->len;
+  ushort right_len = node_ref_descend(parent, index + 1).node->len;
+  if (left_len + right_len + 1 <= target ||
+      left_len + right_len < 2 * (B - 1)) {
+    node_ref_merge(parent, index);
+    return true;
+  }
+  ushort new_left_len = left_len + right_len - (B - 1);
+  if (new_left_len > target) {
+    new_left_len = target;
+  }
+  if (new_left_len > left_len) {
+    node_ref_shift_left(parent, index, new_left_len - left_len);
+  } else if (right_len < B - 1) {
+    node_ref_shift_right(parent, index + 1, B - 1 - right_len);
+  }
+  return false;
+}
+
+/* Redistribute the elements of the children of node_ref in as few nodes as
+   possible holding at most `target` elements each. The children are filled from
+   left to right, pulling elements from their right siblings and deallocating
+   the siblings that end up empty. */
+static void node_ref_pack_children(struct node_ref node_ref, ushort target) {
+  /* How many elements are left in the children yet to pack, counting the
+     separating elements in node_ref. */
+  size_t remaining = node_ref.node->len;
+  for (ushort index = 0; index <= node_ref.node->len; ++index) {
+    remaining += node_ref_descend(node_ref, index).node->len;
+  }
+
+  ushort index = 0;
+  while (index < node_ref.node->len) {
+    /* Spread what is left over the least number of nodes, without making any
+       of them underfull. */
+    size_t count = (remaining + target + 1) / (target + 1);
+    if (count > (remaining + 1) / B) {
+      count = (remaining + 1) / B;
+    }
+    if (count == 0) {
+      count = 1;
+    }
+    ushort want = remaining / count;
+
+    ushort left_len = node_ref_descend(node_ref, index).node->len;
+    ushort right_len = node_ref_descend(node_ref, index + 1).node->len;
+    if (left_len + 1 + right_len <= want) {
+      node_ref_merge(node_ref, index);
+      continue;
+    }
+    if (left_len < want) {
+      node_ref_shift_left(node_ref, index, want - left_len);
+      left_len = want;
+    }
+    remaining -= left_len + 1;
+    index += 1;
+  }
+
+  if (node_ref.node->len > 0 &&
+      node_ref_descend(node_ref, index).node->len < B - 1) {
+    node_ref_pack_pair(node_ref, index - 1, target);
+  }
+}
+
+struct compact_step {
+  ushort target;
+  /* The height of the nodes being packed. */
+  size_t height;
+  /* How many nodes were visited. */
+  size_t work;
+  /* Whether an underfull node was rebalanced on the way back to the root. */
+  bool fixed;
+  /* Whether `path` was moved to the next node to pack. */
+  bool has_next;
+};
+
+/* Rebalance the underfull child at `path[node_ref.height]` with a sibling, and
+   update the path so that it still leads to the node that was packed. */
+static void node_ref_fix_child(struct node_ref node_ref, ushort *path,
+                               struct compact_step *step) {
+  ushort index = path[node_ref.height];
+  /* Whether the path goes on below the child. */
+  bool deeper = node_ref.height - 1 > step->height + 1;
+  if (index == 0) {
+    /* The child only gains elements at its end. */
+    node_ref_pack_pair(node_ref, 0, step->target);
+    return;
+  }
+
+  ushort left_len = node_ref_descend(node_ref, index - 1).node->len;
+  ushort len = node_ref_descend(node_ref, index).node->len;
+  /* How many of the child's first children moved to its left sibling. */
+  ushort moved;
+  if (node_ref_pack_pair(node_ref, index - 1, step->target)) {
+    moved = len + 1;
+  } else {
+    ushort new_len = node_ref_descend(node_ref, index).node->len;
+    if (new_len > len) {
+      /* Children were moved in front of the child's. */
+      if (deeper) {
+        path[node_ref.height - 1] += new_len - len;
+      }
+      return;
+    }
+    moved = len - new_len;
+  }
+  if (!deeper) {
+    /* Pack the left sibling again, it now holds part of the packed node. */
+    if (moved > 0) {
+      path[node_ref.height] = index - 1;
+    }
+  } else if (path[node_ref.height - 1] < moved) {
+    path[node_ref.height] = index - 1;
+    path[node_ref.height - 1] += left_len + 1;
+  } else {
+    path[node_ref.height - 1] -= moved;
+  }
+}
+
+/* Follow `path` down and pack the children of the node it leads to at height
+   `step->height + 1`. Nodes that the packing left underfull are rebalanced
+   with a sibling on the way back, otherwise `path` is moved to the next node
+   to pack. */
+#if LAZY_REMOVE
+/* Drop the dead elements of a leaf. */
+static void leaf_purge_dead(struct leaf_node *node) {
+  ushort len = 0;
+  for (ushort i = 0; i < node->len; ++i) {
+    if (node->dead[i]) {
+      kv_dealloc(node_kv(node, i));
+    } else {
+      node_set_kv(node, len, node_kv(node, i));
+      len += 1;
+    }
+  }
+  node->len = len;
+}
+
+/* Drop the dead elements of a node right above the leaves and of its
+   children, before packing them. The children may be left underfull or
+   empty, and the node without any key. */
+static void node_ref_purge_dead_leaves(struct node_ref node_ref) {
+  assert(node_ref.height == 1);
+  for (ushort index = 0; index <= node_ref.node->len; ++index) {
+    leaf_purge_dead(node_ref_descend(node_ref, index).node);
+  }
+  ushort index = 0;
+  while (index < node_ref.node->len) {
+    if (!node_ref.node->dead[index]) {
+      index += 1;
+      continue;
+    }
+    /* Replace the dead separator with a neighbour from a leaf. */
+    struct leaf_node *left = node_ref_descend(node_ref, index).node;
+    struct leaf_node *right = node_ref_descend(node_ref, index + 1).node;
+    if (left->len > 0) {
+      kv_dealloc(node_kv(node_ref.node, index));
+      node_set_kv(node_ref.node, index,
+                  node_remove_unchecked(left, left->len - 1));
+      index += 1;
+    } else if (right->len > 0) {
+      kv_dealloc(node_kv(node_ref.node, index));
+      node_set_kv(node_ref.node, index, node_remove_unchecked(right, 0));
+      index += 1;
+    } else {
+      /* Both leaves are empty, merging them leaves only the separator. */
+      node_ref_merge(node_ref, index);
+      leaf_purge_dead(left);
+    }
+  }
+}
+#endif
+
+static void node_ref_compact_recursive(struct node_ref node_ref, ushort *path,
+                                       struct compact_step *step) {
+  if (node_ref.height == step->height + 1) {
+#if LAZY_REMOVE
+    if (node_ref.height == 1) {
+      node_ref_purge_dead_leaves(node_ref);
+    }
+#endif
+    node_ref_pack_children(node_ref, step->target);
+    step->work += node_ref.node->len + 1;
+    return;
+  }
+
+  /* The map may have shrunk since the path was recorded. */
+  if (path[node_ref.height] > node_ref.node->len) {
+    path[node_ref.height] = node_ref.node->len;
+  }
+  ushort index = path[node_ref.height];
+  struct node_ref child = node_ref_descend(node_ref, index);
+  node_ref_compact_recursive(child, path, step);
+  if (child.node->len < B - 1) {
+    node_ref_fix_child(node_ref, path, step);
+    step->fixed = true;
+  } else if (!step->fixed && !step->has_next &&
+             index < node_ref.node->len) {
+    path[node_ref.height] = index + 1;
+    for (size_t height = step->height + 2; height < node_ref.height;
+         ++height) {
+      path[height] = 0;
+    }
+    step->has_next = true;
   }
 }
 
@@ -523,6 +1298,11 @@ V *btree_map_get(struct btree_map *map, K const *key) {
     bool found = false;
     ushort index = node_ref_search(node_ref, key, &found);
     if (found) {
+#if LAZY_REMOVE
+      if (node_ref.node->dead[index]) {
+        return NULL;
+      }
+#endif
       return &node_ref.node->vals[index];
     } else if (node_ref_is_leaf(node_ref)) {
       return NULL;
@@ -537,7 +1317,7 @@ void btree_map_insert(struct btree_map *map, K key, V value) {
      and values. */
   if (map->root == NULL) {
     struct leaf_node *new_root = leaf_node_new();
-    node_insert_unchecked(new_root, 0, key, value);
+    node_insert_unchecked(new_root, 0, kv_new(key, value));
     map->size = 1;
     map->root = new_root;
     /* height is only guaranteed to be initialized when root is not NULL. */
@@ -558,37 +1338,80 @@ void btree_map_insert(struct btree_map *map, K key, V value) {
        split node as child nodes. */
     struct inode *new_root = inode_new();
 
-    node_insert_unchecked(&new_root->data, 0, split.kv.k, split.kv.v);
+    node_insert_unchecked(&new_root->data, 0, split.kv);
     new_root->children[0] = node_ref_from_root(map).node;
     new_root->children[1] = split.node;
 
-    map->root = new_root;
+    map->root = &new_root->data;
     /* Increase the height of the root */
     map->height += 1;
   }
 }
 
+#if LAZY_REMOVE
+/* Whether enough elements of the node are dead to purge them. */
+static bool node_is_mostly_dead(struct leaf_node *node) {
+  ushort dead = 0;
+  for (ushort i = 0; i < node->len; ++i) {
+    dead += node->dead[i];
+  }
+  return dead * 100 > node->len * MAX_DEAD_PERCENT;
+}
+
+static void node_purge_dead(struct btree_map *map, struct leaf_node *node);
+#endif
+
 void btree_map_remove(struct btree_map *map, K const *key) {
   if (map->root == NULL) {
     return;
   }
 
-  if (node_remove_recursive(node_ref_from_root(map), key)) {
+#if LAZY_REMOVE
+  /* Mark the element as dead, the tree is only rebalanced once its node has
+     too many dead elements. */
+  struct node_ref node_ref = node_ref_from_root(map);
+  while (true) {
+    bool found = false;
+    ushort index = node_ref_search(node_ref, key, &found);
+    if (found) {
+      if (!node_ref.node->dead[index]) {
+        node_ref.node->dead[index] = true;
+        map->size -= 1;
+        if (node_is_mostly_dead(node_ref.node)) {
+          node_purge_dead(map, node_ref.node);
+        }
+      }
+      return;
+    } else if (node_ref_is_leaf(node_ref)) {
+      return;
+    }
+    node_ref = node_ref_descend(node_ref, index);
+  }
+#else
+  struct kv removed;
+  if (node_remove_recursive(node_ref_from_root(map), key, &removed)) {
     /* We removed an element from the */
     map->size -= 1;
+#if IS_DEALLOC_ELEMENT
+    DEALLOC_KEY(removed.k);
+    DEALLOC_VALUE(removed.v);
+#else
+    (void)removed;
+#endif
 
     if (((struct leaf_node *)map->root)->len == 0) {
       if (map->height == 0) {
-        DEALLOC(map->root);
+        DEALLOC_NODE(map->root, sizeof(struct leaf_node));
         map->root = NULL;
         return;
       }
-      struct inode *old_root = (struct inode *)map->root;
+      struct inode *old_root = inode_from_leaf(map->root);
       map->root = old_root->children[0];
       map->height -= 1;
-      DEALLOC(old_root);
+      DEALLOC_NODE(old_root, sizeof(struct inode));
     }
   }
+#endif
 }
 
 void btree_map_dealloc(struct btree_map *map) {
@@ -608,6 +1431,7 @@ struct btree_map_iter btree_map_iter(struct btree_map *map) {
   struct btree_map_iter it;
   if (map->root == NULL) {
     it.node = NULL;
+    it.max_height = 0;
     return it;
   }
   it.max_height = map->height;
@@ -649,21 +1473,28 @@ bool btree_map_iter_next(struct btree_map_iter *it, K **key, V **value) {
     if (it->index < ((struct leaf_node *)it->node)->len) {
       *key = &((struct leaf_node *)it->node)->keys[it->index];
       *value = &((struct leaf_node *)it->node)->vals[it->index];
+#if LAZY_REMOVE
+      bool dead = ((struct leaf_node *)it->node)->dead[it->index];
+#endif
       it->index += 1;
       if (it->height != 0) {
         it->height -= 1;
         it->parents[it->height] = it->node;
         it->indexes[it->height] = it->index;
-        it->node = ((struct inode *)it->node)->children[it->index];
+        it->node = inode_from_leaf(it->node)->children[it->index];
         it->index = 0;
-        printf("%zu\n", it->height);
         while (it->height != 0) {
           it->height -= 1;
           it->parents[it->height] = it->node;
           it->indexes[it->height] = 0;
-          it->node = ((struct inode *)it->node)->children[0];
+          it->node = inode_from_leaf(it->node)->children[0];
         }
       }
+#if LAZY_REMOVE
+      if (dead) {
+        continue;
+      }
+#endif
       return true;
     } else if (it->height >= it->max_height) {
       return false;
@@ -676,10 +1507,616 @@ bool btree_map_iter_next(struct btree_map_iter *it, K **key, V **value) {
   }
 }
 
-void btree_map_iter_dealloc(struct btree_map_iter *it) { DEALLOC(it->parents); }
+void btree_map_iter_dealloc(struct btree_map_iter *it) {
+  if (it->max_height != 0) {
+    DEALLOC(it->parents);
+  }
+}
+
+/* Make room for a path of `levels` nodes in the cursor, keeping the current
+   path. */
+static void cursor_reserve(struct btree_map_cursor *cursor, size_t levels) {
+  if (levels <= cursor->capacity) {
+    return;
+  }
+  void **nodes = _alloc_checked(levels * sizeof(void *) +
+                                levels * sizeof(ushort));
+  ushort *indexes = (ushort *)(nodes + levels);
+  if (cursor->capacity != 0) {
+    memcpy(nodes, cursor->nodes, cursor->capacity * sizeof(void *));
+    memcpy(indexes, cursor->indexes, cursor->capacity * sizeof(ushort));
+    DEALLOC(cursor->nodes);
+  }
+  cursor->nodes = nodes;
+  cursor->indexes = indexes;
+  cursor->capacity = levels;
+}
+
+static inline struct node_ref cursor_node_ref(struct btree_map_cursor *cursor,
+                                              size_t height) {
+  return (struct node_ref){cursor->nodes[height], height};
+}
+
+/* Move to the first element under the node at `height` on the path. */
+static void cursor_descend_first(struct btree_map_cursor *cursor,
+                                 size_t height) {
+  for (; height != 0; --height) {
+    cursor->indexes[height] = 0;
+    cursor->nodes[height - 1] =
+        node_ref_descend(cursor_node_ref(cursor, height), 0).node;
+  }
+  cursor->indexes[0] = 0;
+  cursor->height = 0;
+}
+
+/* Move to the last element under the node at `height` on the path. */
+static void cursor_descend_last(struct btree_map_cursor *cursor,
+                                size_t height) {
+  for (; height != 0; --height) {
+    struct node_ref node_ref = cursor_node_ref(cursor, height);
+    cursor->indexes[height] = node_ref.node->len;
+    cursor->nodes[height - 1] =
+        node_ref_descend(node_ref, node_ref.node->len).node;
+  }
+  cursor->indexes[0] = ((struct leaf_node *)cursor->nodes[0])->len - 1;
+  cursor->height = 0;
+}
+
+/* An index equal to the length of its node stands for the element after the
+   node in its ancestors, move to that element or to the ghost position. */
+static void cursor_settle(struct btree_map_cursor *cursor) {
+  while (cursor->indexes[cursor->height] ==
+         ((struct leaf_node *)cursor->nodes[cursor->height])->len) {
+    if (cursor->height == cursor->map->height) {
+      cursor->ghost = true;
+      return;
+    }
+    /* The index of the child we came from is also the index of the element
+       after it. */
+    cursor->height += 1;
+  }
+}
+
+/* Rebalance the underfull nodes on the path after removing an element from the
+   leaf on it, updating the path to keep pointing to the same position. */
+static void cursor_fix_underflow(struct btree_map_cursor *cursor) {
+  for (size_t height = 1; height <= cursor->map->height; ++height) {
+    struct node_ref parent = cursor_node_ref(cursor, height);
+    ushort index = cursor->indexes[height];
+    struct node_ref child = node_ref_descend(parent, index);
+    if (child.node->len >= B - 1) {
+      return;
+    }
+    if (index == 0) {
+      /* The child keeps its elements in place, it only gains some at the
+         end. */
+      if (node_ref_descend(parent, 1).node->len > B) {
+        node_ref_borrow_from_right(parent, 0);
+      } else {
+        node_ref_merge(parent, 0);
+      }
+    } else {
+      struct node_ref left = node_ref_descend(parent, index - 1);
+      ushort left_len = left.node->len;
+      ushort child_len = child.node->len;
+      if (left_len > B) {
+        ushort shift = ((child_len + left_len) >> 1) - child_len;
+        node_ref_shift_right(parent, index, shift);
+        cursor->indexes[height - 1] += shift;
+      } else {
+        /* child is merged at the end of its left sibling. */
+        node_ref_merge(parent, index - 1);
+        cursor->nodes[height - 1] = left.node;
+        cursor->indexes[height - 1] += left_len + 1;
+        cursor->indexes[height] = index - 1;
+      }
+    }
+  }
+}
+
+struct btree_map_cursor btree_map_cursor(struct btree_map *map) {
+  struct btree_map_cursor cursor;
+  cursor.map = map;
+  cursor.nodes = NULL;
+  cursor.indexes = NULL;
+  cursor.capacity = 0;
+  cursor.height = 0;
+  cursor.ghost = true;
+  if (map->root != NULL) {
+    cursor_reserve(&cursor, map->height + 1);
+  }
+  return cursor;
+}
+
+/* Move to the next element, including dead ones. */
+static bool cursor_next(struct btree_map_cursor *cursor) {
+  struct btree_map *map = cursor->map;
+  if (cursor->ghost) {
+    if (map->root == NULL) {
+      return false;
+    }
+    cursor->nodes[map->height] = map->root;
+    cursor_descend_first(cursor, map->height);
+    cursor->ghost = false;
+    return true;
+  }
+  size_t height = cursor->height;
+  if (height != 0) {
+    /* The next element is the first one in the child after the current
+       element. */
+    cursor->indexes[height] += 1;
+    cursor->nodes[height - 1] =
+        node_ref_descend(cursor_node_ref(cursor, height),
+                         cursor->indexes[height])
+            .node;
+    cursor_descend_first(cursor, height - 1);
+    return true;
+  }
+  cursor->indexes[0] += 1;
+  cursor_settle(cursor);
+  return !cursor->ghost;
+}
+
+/* Move to the previous element, including dead ones. */
+static bool cursor_prev(struct btree_map_cursor *cursor) {
+  struct btree_map *map = cursor->map;
+  if (cursor->ghost) {
+    if (map->root == NULL) {
+      return false;
+    }
+    cursor->nodes[map->height] = map->root;
+    cursor_descend_last(cursor, map->height);
+    cursor->ghost = false;
+    return true;
+  }
+  size_t height = cursor->height;
+  if (height != 0) {
+    /* The previous element is the last one in the child before the current
+       element. */
+    cursor->nodes[height - 1] =
+        node_ref_descend(cursor_node_ref(cursor, height),
+                         cursor->indexes[height])
+            .node;
+    cursor_descend_last(cursor, height - 1);
+    return true;
+  }
+  /* Go up until there is an element before the child we came from. */
+  while (cursor->indexes[height] == 0) {
+    if (height == map->height) {
+      cursor->ghost = true;
+      return false;
+    }
+    height += 1;
+  }
+  cursor->indexes[height] -= 1;
+  cursor->height = height;
+  return true;
+}
+
+/* Whether the cursor is on a dead element. */
+static inline bool cursor_is_dead(struct btree_map_cursor *cursor) {
+#if LAZY_REMOVE
+  return !cursor->ghost &&
+         ((struct leaf_node *)cursor->nodes[cursor->height])
+             ->dead[cursor->indexes[cursor->height]];
+#else
+  (void)cursor;
+  return false;
+#endif
+}
+
+#if LAZY_REMOVE
+/* Move the cursor to `key`, or to the position in a leaf where it would be
+   inserted if it's not in the map. Returns whether the key was found. */
+static bool cursor_seek(struct btree_map_cursor *cursor, K const *key) {
+  struct btree_map *map = cursor->map;
+  cursor_reserve(cursor, map->height + 1);
+  cursor->nodes[map->height] = map->root;
+  cursor->ghost = false;
+  for (size_t height = map->height;; --height) {
+    struct node_ref node_ref = cursor_node_ref(cursor, height);
+    bool found = false;
+    ushort index = node_ref_search(node_ref, key, &found);
+    cursor->indexes[height] = index;
+    if (found || height == 0) {
+      cursor->height = height;
+      return found;
+    }
+    cursor->nodes[height - 1] = node_ref_descend(node_ref, index).node;
+  }
+}
+#endif
+
+/* Remove the current element from the tree and move to the next one, which
+   may be dead. Doesn't update the size of the map. */
+static struct kv cursor_remove(struct btree_map_cursor *cursor) {
+  assert(!cursor->ghost);
+  struct btree_map *map = cursor->map;
+  size_t height = cursor->height;
+  struct leaf_node *node = cursor->nodes[height];
+  ushort index = cursor->indexes[height];
+  struct kv removed = node_kv(node, index);
+
+  bool from_inode = height != 0;
+  if (from_inode) {
+    /* Replace the element with its predecessor, which is the last element of
+       a leaf, and remove that one instead. The position right after the
+       predecessor's old place then stands for its new place. */
+    cursor->nodes[height - 1] =
+        node_ref_descend(cursor_node_ref(cursor, height), index).node;
+    cursor_descend_last(cursor, height - 1);
+    struct kv kv = node_remove_unchecked(cursor->nodes[0], cursor->indexes[0]);
+    node_set_kv(node, index, kv);
+  } else {
+    node_remove_unchecked(node, index);
+  }
+
+  cursor_fix_underflow(cursor);
+
+  struct leaf_node *root = map->root;
+  if (root->len == 0) {
+    if (map->height == 0) {
+      DEALLOC_NODE(root, sizeof(struct leaf_node));
+      map->root = NULL;
+      cursor->ghost = true;
+      return removed;
+    }
+    map->root = inode_from_leaf(root)->children[0];
+    map->height -= 1;
+    DEALLOC_NODE(inode_from_leaf(root), sizeof(struct inode));
+  }
+
+  cursor_settle(cursor);
+  if (from_inode) {
+    /* We are on the predecessor, the element after the removed one is right
+       after it. */
+    cursor_next(cursor);
+  }
+  return removed;
+}
+
+bool btree_map_cursor_next(struct btree_map_cursor *cursor) {
+  bool more = cursor_next(cursor);
+  while (more && cursor_is_dead(cursor)) {
+    more = cursor_next(cursor);
+  }
+  return more;
+}
+
+bool btree_map_cursor_prev(struct btree_map_cursor *cursor) {
+  bool more = cursor_prev(cursor);
+  while (more && cursor_is_dead(cursor)) {
+    more = cursor_prev(cursor);
+  }
+  return more;
+}
+
+bool btree_map_cursor_get(struct btree_map_cursor *cursor, K **key,
+                          V **value) {
+  if (cursor->ghost) {
+    return false;
+  }
+  struct leaf_node *node = cursor->nodes[cursor->height];
+  *key = &node->keys[cursor->indexes[cursor->height]];
+  *value = &node->vals[cursor->indexes[cursor->height]];
+  return true;
+}
+
+void btree_map_cursor_remove(struct btree_map_cursor *cursor, K *key,
+                             V *value) {
+  struct kv kv = cursor_remove(cursor);
+  cursor->map->size -= 1;
+  if (key != NULL) {
+    *key = kv.k;
+  }
+  if (value != NULL) {
+    *value = kv.v;
+  }
+  if (cursor_is_dead(cursor)) {
+    btree_map_cursor_next(cursor);
+  }
+}
+
+void btree_map_cursor_insert(struct btree_map_cursor *cursor, K key,
+                             V value) {
+  struct btree_map *map = cursor->map;
+  if (map->root == NULL) {
+    struct leaf_node *new_root = leaf_node_new();
+    node_insert_unchecked(new_root, 0, kv_new(key, value));
+    map->size = 1;
+    map->root = new_root;
+    map->height = 0;
+    cursor_reserve(cursor, 1);
+    cursor->nodes[0] = new_root;
+    cursor->indexes[0] = 0;
+    cursor->height = 0;
+    cursor->ghost = false;
+    return;
+  }
+
+#if LAZY_REMOVE
+  /* A removed element with the same key may still be in the tree, the only
+     safe place to insert is where a search would put it. */
+  if (cursor_seek(cursor, &key)) {
+    node_revive(cursor->nodes[cursor->height],
+                cursor->indexes[cursor->height], key, value);
+    map->size += 1;
+    return;
+  }
+#else
+  /* Find the position in a leaf right before the current element. */
+  if (cursor->ghost) {
+    cursor->nodes[map->height] = map->root;
+    cursor_descend_last(cursor, map->height);
+    cursor->indexes[0] += 1;
+  } else {
+    K *current;
+    V *current_value;
+    btree_map_cursor_get(cursor, &current, &current_value);
+    assert(COMPARE(&key, current) < 0);
+    if (cursor->height != 0) {
+      size_t height = cursor->height;
+      cursor->nodes[height - 1] =
+          node_ref_descend(cursor_node_ref(cursor, height),
+                           cursor->indexes[height])
+              .node;
+      cursor_descend_last(cursor, height - 1);
+      cursor->indexes[0] += 1;
+    }
+  }
+#endif
+  cursor->ghost = false;
+  map->size += 1;
+
+  struct split split =
+      node_insert(cursor_node_ref(cursor, 0), cursor->indexes[0],
+                  kv_new(key, value));
+  /* Follow the new element through the splits. At cursor->height the index is
+     the one of the element, above it it's the one of the child on the path. */
+  for (size_t height = 0; split.node != NULL; ++height) {
+    ushort left_len = ((struct leaf_node *)cursor->nodes[height])->len;
+    ushort index = cursor->indexes[height];
+    bool went_right = index > left_len;
+    if (went_right) {
+      cursor->nodes[height] = split.node;
+      cursor->indexes[height] = index - left_len - 1;
+    } else if (height == cursor->height && index == left_len) {
+      /* The element was moved up to the parent, where it's inserted at the
+         index of the child we came from. */
+      cursor->height += 1;
+    }
+
+    if (height == map->height) {
+      /* Root was split, see btree_map_insert. */
+      struct inode *new_root = inode_new();
+      node_insert_unchecked(&new_root->data, 0, split.kv);
+      new_root->children[0] = map->root;
+      new_root->children[1] = split.node;
+      map->root = &new_root->data;
+      map->height += 1;
+      cursor_reserve(cursor, map->height + 1);
+      cursor->nodes[map->height] = map->root;
+      cursor->indexes[map->height] = went_right ? 1 : 0;
+      break;
+    }
+
+    ushort child_index = cursor->indexes[height + 1];
+    if (went_right) {
+      cursor->indexes[height + 1] += 1;
+    }
+    split = node_insert_with_child(cursor_node_ref(cursor, height + 1),
+                                   child_index, split.kv, split.node);
+  }
+}
+
+void btree_map_cursor_dealloc(struct btree_map_cursor *cursor) {
+  if (cursor->capacity != 0) {
+    DEALLOC(cursor->nodes);
+  }
+}
+
+#if LAZY_REMOVE
+/* Take the dead element under the cursor out of the tree for good. */
+static void cursor_purge(struct btree_map_cursor *cursor) {
+  kv_dealloc(cursor_remove(cursor));
+}
+
+static void node_purge_dead(struct btree_map *map, struct leaf_node *node) {
+  /* Rebalancing moves elements between nodes, so remember the dead keys and
+     look for each of them. */
+  K dead[CAPACITY];
+  ushort count = 0;
+  for (ushort i = 0; i < node->len; ++i) {
+    if (node->dead[i]) {
+      dead[count++] = node->keys[i];
+    }
+  }
+  struct btree_map_cursor cursor = btree_map_cursor(map);
+  for (ushort i = 0; i < count; ++i) {
+    bool found = cursor_seek(&cursor, &dead[i]);
+    assert(found);
+    (void)found;
+    cursor_purge(&cursor);
+  }
+  btree_map_cursor_dealloc(&cursor);
+}
+
+void btree_map_flush(struct btree_map *map) {
+  struct btree_map_cursor cursor = btree_map_cursor(map);
+  bool more = cursor_next(&cursor);
+  while (more) {
+    if (cursor_is_dead(&cursor)) {
+      cursor_purge(&cursor);
+      more = !cursor.ghost;
+    } else {
+      more = cursor_next(&cursor);
+    }
+  }
+  btree_map_cursor_dealloc(&cursor);
+}
+#endif
+
+struct btree_map_compactor btree_map_compactor(struct btree_map *map,
+                                               unsigned short target_fill) {
+  struct btree_map_compactor compactor;
+  compactor.map = map;
+  if (target_fill < B - 1) {
+    target_fill = B - 1;
+  } else if (target_fill > CAPACITY) {
+    target_fill = CAPACITY;
+  }
+  compactor.target_fill = target_fill;
+  compactor.height = 0;
+  memset(compactor.path, 0, sizeof(compactor.path));
+  return compactor;
+}
+
+bool btree_map_compactor_step(struct btree_map_compactor *compactor,
+                              size_t budget) {
+  struct btree_map *map = compactor->map;
+  size_t work = 0;
+  while (map->root != NULL && compactor->height < map->height) {
+    if (work >= budget && work != 0) {
+      return true;
+    }
+    struct compact_step step;
+    step.target = compactor->target_fill;
+    step.height = compactor->height;
+    step.work = 0;
+    step.fixed = false;
+    step.has_next = false;
+    node_ref_compact_recursive(node_ref_from_root(map), compactor->path,
+                               &step);
+    work += step.work;
+
+    if (((struct leaf_node *)map->root)->len == 0) {
+      /* The root's children were merged into one. */
+      struct inode *old_root = inode_from_leaf(map->root);
+      map->root = old_root->children[0];
+      map->height -= 1;
+      DEALLOC_NODE(old_root, sizeof(struct inode));
+#if LAZY_REMOVE
+      if (map->height == 0 && ((struct leaf_node *)map->root)->len == 0) {
+        /* Every element was dead. */
+        DEALLOC_NODE(map->root, sizeof(struct leaf_node));
+        map->root = NULL;
+      }
+#endif
+    }
+
+    /* If rebalancing moved unpacked nodes next to the one we just packed, the
+       path still leads to it and it's packed again. */
+    if (!step.fixed && !step.has_next) {
+      /* Done with this level, start over from the left one level up. */
+      compactor->height += 1;
+      memset(compactor->path, 0, sizeof(compactor->path));
+    }
+  }
+  return false;
+}
+
+void btree_map_compact(struct btree_map *map, unsigned short target_fill) {
+#if LAZY_REMOVE
+  /* The compactor only purges dead elements in and right above the leaves. */
+  btree_map_flush(map);
+#endif
+  struct btree_map_compactor compactor = btree_map_compactor(map, target_fill);
+  btree_map_compactor_step(&compactor, SIZE_MAX);
+}
 
 #include <time.h>
 
+/* Build with -DBENCH=1 to replace the demo with a benchmark of btree_map_get
+   on a large map. Takes the number of elements, the number of lookups and,
+   with NODE_HUGE_PAGES, the NUMA node for the leaves. With NODE_HUGE_PAGES the
+   same map is timed with nodes from ALLOC and then from huge pages. Keys are
+   strings by default, for integer keys build with e.g.:
+     cc -O2 -DBENCH=1 -DNODE_HUGE_PAGES=1 -DK=long -DV=long \
+       '-DCOMPARE(x, y)=((*(x) > *(y)) - (*(x) < *(y)))' \
+       -DIS_DEALLOC_ELEMENT=0 '-DBENCH_KEY(n)=((long)(n))' btree.c */
+#ifndef BENCH
+#define BENCH 0
+#endif
+
+#if BENCH
+#ifndef BENCH_KEY
+#define BENCH_KEY(n) bench_str_key(n)
+
+static char *bench_str_key(unsigned long long n) {
+  char *key = _alloc_checked(24);
+  snprintf(key, 24, "%020llu", n);
+  return key;
+}
+#endif
+
+static unsigned long long bench_random(unsigned long long *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/* The i-th key inserted, multiplying by an odd number keeps them distinct
+   while spreading them over the whole range. */
+static unsigned long long bench_key(unsigned long long i) {
+  return (i * 0x9E3779B97F4A7C15ull) >> 1;
+}
+
+/* Insert `count` elements and time `queries` lookups of random keys, half of
+   which are in the map. */
+static void bench_get(const char *name, size_t count, size_t queries) {
+  struct btree_map map = btree_map_new();
+  for (size_t i = 0; i < count; ++i) {
+    btree_map_insert(&map, BENCH_KEY(bench_key(i)), (V)i);
+  }
+  unsigned long long state = 88172645463325252ull;
+  K *keys = _alloc_checked(queries * sizeof(K));
+  for (size_t i = 0; i < queries; ++i) {
+    keys[i] = BENCH_KEY(bench_key(bench_random(&state) % (2 * count)));
+  }
+
+  size_t hits = 0;
+  clock_t start = clock();
+  for (size_t i = 0; i < queries; ++i) {
+    hits += btree_map_get(&map, &keys[i]) != NULL;
+  }
+  clock_t end = clock();
+  printf("%s: %zu elements, height %zu, %.1f ns/get, %zu hits\n", name,
+         map.size, map.height,
+         (double)(end - start) * 1e9 / CLOCKS_PER_SEC / (double)queries, hits);
+
+#if IS_DEALLOC_ELEMENT
+  for (size_t i = 0; i < queries; ++i) {
+    DEALLOC_KEY(keys[i]);
+  }
+#endif
+  DEALLOC(keys);
+  btree_map_dealloc(&map);
+}
+
+int main(int argc, char **argv) {
+  size_t count = argc > 1 ? strtoull(argv[1], NULL, 10) : 4000000;
+  size_t queries = argc > 2 ? strtoull(argv[2], NULL, 10) : 4000000;
+  if (count == 0) {
+    count = 1;
+  }
+  bench_get("malloc", count, queries);
+#if NODE_HUGE_PAGES
+  int numa_node = argc > 3 ? atoi(argv[3]) : -1;
+  /* Enough for the leaves even if they're only half full. */
+  size_t max_size = (count / (B - 1) + 1) * sizeof(struct leaf_node);
+  if (!btree_huge_pages_open(max_size, numa_node)) {
+    perror("btree_huge_pages_open");
+    return 1;
+  }
+  bench_get("huge pages", count, queries);
+  btree_huge_pages_close();
+#else
+  (void)argv;
+#endif
+  return 0;
+}
+#else
 int main(void) {
   /*  BTreeMap map = btree_map_new();
     long start_time, end_time, elapsed;
@@ -723,3 +2160,4 @@ int main(void) {
   btree_map_iter_dealloc(&it);
   btree_map_dealloc(&map);
 }
+#endif
@@ -5,7 +5,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+/* Nodes hold between B - 1 and 2 * B - 1 elements. */
+#ifndef B
 #define B 6
+#endif
 
 /* Change the BTreeMap allocator */
 #define ALLOC(size) malloc(size)
@@ -17,9 +20,52 @@
     exit(1);                                                                   \
   } while (false);
 
+/* Store the children of internal nodes before their keys instead of after
+   their values, a search then only touches keys and child pointers on the way
+   down. With the default B and small values the whole node spans only a few
+   cache lines either way, so this only helps when values are large. */
+#ifndef INODE_CHILDREN_FIRST
+#define INODE_CHILDREN_FIRST 0
+#endif
+
+/* Allocate the nodes in a file mapped in memory instead of using ALLOC, the
+   kernel can then write cold nodes back to the file and evict them, so the map
+   can grow past the available memory. Requires POSIX and pthreads, see
+   btree_node_file_open. */
+#ifndef NODE_FILE
+#define NODE_FILE 0
+#endif
+
+/* Allocate the nodes from memory backed by 2 MiB huge pages instead of using
+   ALLOC, so that lookups in large maps miss the TLB less often. Internal nodes
+   and leaves are kept apart and can be placed on different NUMA nodes.
+   Requires Linux and pthreads, see btree_huge_pages_open. Can't be used with
+   NODE_FILE. */
+#ifndef NODE_HUGE_PAGES
+#define NODE_HUGE_PAGES 0
+#endif
+
+/* Make btree_map_remove only mark elements as dead instead of removing them
+   and rebalancing the tree right away. Lookups and iteration skip dead
+   elements, and inserting a dead key brings it back in place. The dead
+   elements of a node are removed together once more than MAX_DEAD_PERCENT of
+   them are dead, or by btree_map_flush. This avoids merging nodes that the
+   next inserts would split again.
+   Dead keys are still used to search the tree, so they're only deallocated
+   when the element is purged, the caller must not use them after removing
+   either way. */
+#ifndef LAZY_REMOVE
+#define LAZY_REMOVE 0
+#endif
+#ifndef MAX_DEAD_PERCENT
+#define MAX_DEAD_PERCENT 50
+#endif
+
+#ifndef IS_DEALLOC_ELEMENT
 #define DEALLOC_KEY(key) DEALLOC(key)
 #define DEALLOC_VALUE(value)
 #define IS_DEALLOC_ELEMENT 1
+#endif
 
 /* The type of the keys, make sure you also modify COMPARE if you use anything
    other than integers. */
@@ -27,6 +73,26 @@
 #define K char *
 #endif
 
+/* How keys are searched inside a node:
+   - SEARCH_LINEAR compares keys in order and stops at the first one that is
+     not less than the searched key, best for the default B.
+   - SEARCH_BINARY is better for a large B or expensive comparisons.
+   - SEARCH_SIMD compares all the keys of the node without branching, which
+     the compiler can vectorize for integer keys.
+   - SEARCH_INTERPOLATION guesses the position of the key from the first and
+     last key of the node and scans from there, best for a large B and evenly
+     spread keys, such as timestamps or IDs. Requires KEY_POSITION. */
+#define SEARCH_LINEAR 0
+#define SEARCH_BINARY 1
+#define SEARCH_SIMD 2
+#define SEARCH_INTERPOLATION 3
+#ifndef SEARCH
+#define SEARCH SEARCH_LINEAR
+#endif
+
+/* For SEARCH_INTERPOLATION, convert a key to a number that grows along with
+   the key, e.g. `#define KEY_POSITION(x) ((double)*x)` for integer keys. */
+
 /* The type of the values */
 #ifndef V
 #define V int
@@ -68,11 +134,19 @@ V *btree_map_get(struct btree_map *map, K const *key);
    the iterator. */
 void btree_map_insert(struct btree_map *map, K key, V value);
 
-/* Remove a key and its associated value from the map.
+/* Remove a key and its associated value from the map. The map owns the keys
+   and values it holds, so the removed ones are deallocated with DEALLOC_KEY
+   and DEALLOC_VALUE (with LAZY_REMOVE, once the element is purged) and must
+   not be used or deallocated by the caller afterwards.
    **Note:** Don't call this function while iterating or you might invalidate
    the iterator. */
 void btree_map_remove(struct btree_map *map, K const *key);
 
+#if LAZY_REMOVE
+/* Remove all the dead elements from the map and rebalance it. */
+void btree_map_flush(struct btree_map *map);
+#endif
+
 /* Remove all elements from the map. */
 void btree_map_clear(struct btree_map *map);
 
@@ -106,4 +180,141 @@ void btree_map_iter_reset(struct btree_map_iter *it);
 
 void btree_map_iter_dealloc(struct btree_map_iter *it);
 
+struct btree_map_cursor {
+  struct btree_map *map;
+  /* The path from the root to the current element, `nodes[h]` is the node at
+     height h. `indexes[h]` is the index of the current element if h is
+     `height`, the index of the child on the path otherwise. */
+  void **nodes;
+  unsigned short *indexes;
+  /* How many levels the path can hold. */
+  size_t capacity;
+  /* The height of the node holding the current element. */
+  size_t height;
+  /* Whether the cursor is on the ghost position, between the last and the
+     first element. */
+  bool ghost;
+};
+
+/* Create a cursor on the ghost position of the map, which comes right after
+   the last element and right before the first. Unlike iterators, cursors can
+   move in both directions and modify the map at their position without having
+   to search from the root again. btree_map_insert and btree_map_remove still
+   invalidate any cursor.
+   **Note:** the cursor allocates memory for its path, so it must be
+   deallocated using btree_map_cursor_dealloc. */
+struct btree_map_cursor btree_map_cursor(struct btree_map *map);
+
+/* Move to the next element. Returns false if the cursor moved to the ghost
+   position. */
+bool btree_map_cursor_next(struct btree_map_cursor *cursor);
+
+/* Move to the previous element. Returns false if the cursor moved to the ghost
+   position. */
+bool btree_map_cursor_prev(struct btree_map_cursor *cursor);
+
+/* Get the current element. Returns false on the ghost position. */
+bool btree_map_cursor_get(struct btree_map_cursor *cursor, K **key,
+                          V **value);
+
+/* Remove the current element, moving the cursor to the next one. The removed
+   key and value are stored in `key` and `value` if they're not NULL, so that
+   they can be deallocated. The cursor must not be on the ghost position.
+   With LAZY_REMOVE the element is removed right away rather than marked as
+   dead, and the cursor skips over dead elements. */
+void btree_map_cursor_remove(struct btree_map_cursor *cursor, K *key,
+                             V *value);
+
+/* Insert an element right before the current one (or after the last one on the
+   ghost position) and move the cursor to it. The key must not be in the map and
+   must sort between the previous element and the current one. */
+void btree_map_cursor_insert(struct btree_map_cursor *cursor, K key, V value);
+
+void btree_map_cursor_dealloc(struct btree_map_cursor *cursor);
+
+struct btree_map_compactor {
+  struct btree_map *map;
+  unsigned short target_fill;
+  /* The height of the nodes currently being packed. */
+  size_t height;
+  /* The index of the child to descend into at each height to reach the next
+     node whose children should be packed. Indexes past the end of a node are
+     clamped, so a path made stale by modifying the map only makes the
+     compactor redo or skip some nodes. Every level at least doubles the
+     number of elements, so the height fits in the bits of a size_t. */
+  unsigned short path[8 * sizeof(size_t)];
+};
+
+/* Repack the nodes of the map in key order so that each node holds about
+   `target_fill` elements, deallocating the nodes that are left empty.
+   `target_fill` is clamped between B - 1 and 2 * B - 1. Invalidates pointers
+   returned by btree_map_get and any iterator. With LAZY_REMOVE the dead
+   elements are purged first, while an incremental compaction only purges the
+   ones it finds in the leaves and their parents. */
+void btree_map_compact(struct btree_map *map, unsigned short target_fill);
+
+/* Start an incremental compaction of the map. This function doesn't allocate,
+   the work is done by btree_map_compactor_step. */
+struct btree_map_compactor btree_map_compactor(struct btree_map *map,
+                                               unsigned short target_fill);
+
+/* Do some compaction work, visiting about `budget` nodes (always at least the
+   children of one node). Returns true if there is more work to do. The map is
+   valid between steps and can be modified in any way. */
+bool btree_map_compactor_step(struct btree_map_compactor *compactor,
+                              size_t budget);
+
+#if NODE_FILE
+/* Allocate the nodes of every map in the file at `path`, which is created or
+   truncated. Up to `max_size` bytes of the file are reserved for leaves, and
+   enough for the internal nodes above them, and the file grows as needed.
+   Nodes allocated before this call, or once the leaves have used up
+   `max_size` or the disk is full, use ALLOC. Returns false and sets errno on
+   failure. Maps on different threads can share the file, but opening and
+   closing it must not happen while any map is in use.
+   If `max_resident` isn't 0, at most about that many bytes of the file are
+   kept in memory, see btree_node_file_trim. Otherwise the kernel decides.
+   The file is only scratch space: nodes contain pointers, so it cannot be
+   reopened by another process. */
+bool btree_node_file_open(const char *path, size_t max_size,
+                          size_t max_resident);
+
+/* Write leaves back to the file and drop them from memory until the file is
+   within the `max_resident` budget. This happens every time about 1 MiB of
+   nodes is allocated, but lookups and changes to existing nodes bring leaves
+   back in, so call it periodically to bound memory when the map is mostly
+   read. The leaves are evicted in the order of the file,
+   not by how recently they were used, and internal nodes are never evicted.
+   Returns false and sets errno on failure. */
+bool btree_node_file_trim(void);
+
+/* Write the modified nodes back to the file, which makes their memory cheaper
+   to reclaim. Returns false and sets errno on failure. */
+bool btree_node_file_sync(void);
+
+/* Unmap and close the node file. All maps using it must have been deallocated
+   before. */
+void btree_node_file_close(void);
+#endif
+
+#if NODE_HUGE_PAGES
+/* Allocate the nodes of every map from huge pages. Up to `max_size` bytes of
+   address space are reserved for leaves, and enough for the internal nodes
+   above them. Pages reserved for hugetlbfs are used if there are enough of
+   them, otherwise transparent huge pages. Memory is only committed as nodes
+   are allocated. Nodes allocated before this call, or once the leaves have
+   used up `max_size`, use ALLOC.
+   Internal nodes, which every thread walks through, are interleaved over the
+   NUMA nodes the process may use. Leaves go to NUMA node `leaf_numa_node`
+   when it has free memory, or are left where they're first touched if it's
+   negative. Returns false and sets errno on failure.
+   The regions are shared by maps on all threads. This call and
+   btree_huge_pages_close must not run while another thread uses a map. */
+bool btree_huge_pages_open(size_t max_size, int leaf_numa_node);
+
+/* Release the huge page regions. All maps using them must have been
+   deallocated before. */
+void btree_huge_pages_close(void);
+#endif
+
 #endif /* BTREE_H_ */